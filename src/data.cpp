@@ -1,50 +1,251 @@
 #include "data.hpp"
 
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 using namespace std;
 using namespace Eigen;
 
 RandomNumberGenerator rng;
 
-MNIST::MNIST(const string& dir_name, int training_split, int validation_split) :
+/* layout of the cache: header, followed by the inputs and labels of the
+ * training, validation and test data, each aligned to a cache line */
+struct CacheHeader {
+	char magic[8];
+	uint32_t version;
+	int32_t n_inputs;
+	int32_t n_outputs;
+	int32_t n_training_sets;
+	int32_t n_validation_sets;
+	int32_t n_test_sets;
+	uint64_t key;
+};
+
+static const char cache_magic[8] = {'C', 'M', 'L', 'C', 'A', 'C', 'H', 'E'};
+static const uint32_t cache_version = 2;
+
+static size_t cache_aligned(size_t n)
+{
+	return (n + 63)/64*64;
+}
+
+bool Data::read_cache(const string& file_name, uint64_t key)
+{
+	int fd = open(file_name.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+		close(fd);
+		return false;
+	}
+
+	const size_t size = st.st_size;
+	void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (ptr == MAP_FAILED)
+		return false;
+
+	madvise(ptr, size, MADV_SEQUENTIAL);
+
+	const CacheHeader& header = *(const CacheHeader*)ptr;
+
+	const int n_sets[3] = {
+		header.n_training_sets, header.n_validation_sets, header.n_test_sets
+	};
+
+	bool valid = memcmp(header.magic, cache_magic, sizeof(cache_magic)) == 0
+		&& header.version == cache_version
+		&& header.key == key;
+
+	/* make sure the file is complete */
+	size_t expected_size = cache_aligned(sizeof(CacheHeader));
+	for (int i = 0; valid && i < 3; ++i) {
+		expected_size += cache_aligned((size_t)header.n_inputs*n_sets[i]*sizeof(double));
+		expected_size += cache_aligned((size_t)n_sets[i]*sizeof(uint8_t));
+	}
+	valid = valid && size == expected_size;
+
+	if (valid) {
+		n_inputs = header.n_inputs;
+		n_outputs = header.n_outputs;
+
+		const char* pos = (const char*)ptr + cache_aligned(sizeof(CacheHeader));
+
+		Sets* sets[3] = {&training_data, &validation_data, &test_data};
+
+		for (int i = 0; i < 3; ++i) {
+			sets[i]->first = Map<const MatrixXd>((const double*)pos, n_inputs, n_sets[i]);
+			pos += cache_aligned(sets[i]->first.size()*sizeof(double));
+
+			sets[i]->second = Map<const Labels>((const uint8_t*)pos, n_sets[i]);
+			pos += cache_aligned(sets[i]->second.size()*sizeof(uint8_t));
+		}
+	}
+
+	munmap(ptr, size);
+
+	return valid;
+}
+
+bool Data::write_cache(const string& file_name, uint64_t key) const
+{
+	/* written to a temporary file first, so a concurrent run never maps a
+	 * partially written cache */
+	const string tmp_file_name = file_name + ".tmp." + to_string(getpid());
+
+	ofstream fout(tmp_file_name, ios::binary);
+	if (!fout.is_open())
+		return false;
+
+	CacheHeader header = {};
+	memcpy(header.magic, cache_magic, sizeof(cache_magic));
+	header.version = cache_version;
+	header.n_inputs = n_inputs;
+	header.n_outputs = n_outputs;
+	header.n_training_sets = get_n_training_sets();
+	header.n_validation_sets = get_n_validation_sets();
+	header.n_test_sets = get_n_test_sets();
+	header.key = key;
+
+	const char padding[64] = {};
+
+	auto write_aligned = [&](const char* data, size_t size) {
+		fout.write(data, size);
+		fout.write(padding, cache_aligned(size) - size);
+	};
+
+	write_aligned((const char*)&header, sizeof(header));
+
+	for (const Sets* sets : {&training_data, &validation_data, &test_data}) {
+		write_aligned((const char*)sets->first.data(), sets->first.size()*sizeof(double));
+		write_aligned((const char*)sets->second.data(), sets->second.size()*sizeof(uint8_t));
+	}
+
+	fout.close();
+
+	if (!fout.good() || rename(tmp_file_name.c_str(), file_name.c_str()) != 0) {
+		unlink(tmp_file_name.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+uint64_t Data::source_key(const vector<string>& file_names, int training_split,
+		int validation_split)
+{
+	/* FNV-1a hash */
+	uint64_t key = 14695981039346656037ull;
+
+	auto hash = [&](const void* data, size_t size) {
+		for (size_t i = 0; i < size; ++i) {
+			key ^= ((const unsigned char*)data)[i];
+			key *= 1099511628211ull;
+		}
+	};
+
+	for (const string& file_name : file_names) {
+		struct stat st = {};
+		stat(file_name.c_str(), &st);
+
+		hash(file_name.data(), file_name.size());
+		hash(&st.st_size, sizeof(st.st_size));
+		hash(&st.st_mtim.tv_sec, sizeof(st.st_mtim.tv_sec));
+		hash(&st.st_mtim.tv_nsec, sizeof(st.st_mtim.tv_nsec));
+	}
+
+	hash(&training_split, sizeof(training_split));
+	hash(&validation_split, sizeof(validation_split));
+
+	return key;
+}
+
+void Data::print_summary() const
+{
+	cout << "- " << n_inputs << " inputs, " << n_outputs << " outputs" << endl;
+	cout << "- " << get_n_training_sets() << " training data sets" << endl;
+	cout << "- " << get_n_validation_sets() << " validation data sets" << endl;
+	cout << "- " << get_n_test_sets() << " test data sets" << endl << endl;
+}
+
+MNIST::MNIST(const string& dir_name, int training_split, int validation_split,
+		bool use_cache) :
 	Data(dir_name)
 {
+	const string training_images_file = dir_name + "/train-images-idx3-ubyte";
+	const string training_labels_file = dir_name + "/train-labels-idx1-ubyte";
+	const string test_images_file = dir_name + "/t10k-images-idx3-ubyte";
+	const string test_labels_file = dir_name + "/t10k-labels-idx1-ubyte";
+
+	const string cache_file = dir_name + "/cache.bin";
+	const uint64_t key = source_key({training_images_file, training_labels_file,
+			test_images_file, test_labels_file}, training_split, validation_split);
+
+	if (use_cache && read_cache(cache_file, key)) {
+		cout << "- read from cache '" << cache_file << "'" << endl;
+		print_summary();
+		return;
+	}
+
 	/* read training data and labels */
-	MatrixXd training_images = read_mnist_images(dir_name + "/train-images-idx3-ubyte");
-	MatrixXd training_labels = read_mnist_labels(dir_name + "/train-labels-idx1-ubyte");
+	MatrixXd training_images = read_mnist_images(training_images_file);
+	Labels training_labels = read_mnist_labels(training_labels_file);
 
 	/* read test data and labels */
-	MatrixXd test_images = read_mnist_images(dir_name + "/t10k-images-idx3-ubyte");
-	MatrixXd test_labels = read_mnist_labels(dir_name + "/t10k-labels-idx1-ubyte");
+	MatrixXd test_images = read_mnist_images(test_images_file);
+	Labels test_labels = read_mnist_labels(test_labels_file);
 
 	/* determine inputs and outputs of the data set */
 	n_inputs  = training_images.rows();
-	n_outputs = training_labels.rows();
-	cout << "- " << n_inputs << " inputs, " << n_outputs << " outputs" << endl;
+	n_outputs = training_labels.maxCoeff() + 1;
 
 	/* make sure the training and test data have the same layout */
 	assert(test_images.rows() == n_inputs);
-	assert(test_labels.rows() == n_outputs);
+	assert(test_labels.maxCoeff() < n_outputs);
 
 	/* create training data */
 	training_data = make_pair(
 		training_images.leftCols(training_split),
 		training_labels.leftCols(training_split)
 	);
-	cout << "- " << get_n_training_sets() << " training data sets" << endl;
 
 	/* create validation data */
 	validation_data = make_pair(
 		training_images.rightCols(validation_split),
 		training_labels.rightCols(validation_split)
 	);
-	cout << "- " << get_n_validation_sets() << " validation data sets" << endl;
 
 	/* create test data */
 	test_data = make_pair(
 		test_images,
 		test_labels
 	);
-	cout << "- " << get_n_test_sets() << " test data sets" << endl << endl;
+
+	if (use_cache) {
+		if (write_cache(cache_file, key))
+			cout << "- wrote cache '" << cache_file << "'" << endl;
+		else
+			cout << "- warning: could not write cache '" << cache_file << "'" << endl;
+	}
+
+	print_summary();
+}
+
+void MNIST::append(const string& image_file, const string& label_file)
+{
+	cout << "Appending data from '" << image_file << "':" << endl;
+
+	append_training_sets(make_pair(
+		read_mnist_images(image_file),
+		read_mnist_labels(label_file)
+	));
+	cout << endl;
 }
 
 uint32_t MNIST::reverse_int(uint32_t& n)
@@ -86,7 +287,7 @@ MatrixXd MNIST::read_mnist_images(const string& file_name)
 	return images.cast<double>()/255.0;
 }
 
-MatrixXd MNIST::read_mnist_labels(const string& file_name)
+Data::Labels MNIST::read_mnist_labels(const string& file_name)
 {
 	ifstream fin(file_name, ios::binary);
 	assert(fin.is_open());
@@ -98,20 +299,12 @@ MatrixXd MNIST::read_mnist_labels(const string& file_name)
 
 	fin.read((char*)&n_labels, sizeof(n_labels)); reverse_int(n_labels);
 
-	Matrix<uint8_t, Dynamic, 1, 0, Dynamic, 1> _labels(n_labels);
+	Labels labels(n_labels);
 
-	fin.read((char*)_labels.data(), n_labels*sizeof(uint8_t));
+	fin.read((char*)labels.data(), n_labels*sizeof(uint8_t));
 
 	fin.close();
 
-	int n_outputs = _labels.maxCoeff() - _labels.minCoeff() + 1;
-
-	MatrixXd labels(n_outputs, _labels.size());
-	labels.setZero();
-
-	for (int i = 0; i < (int)_labels.size(); ++i)
-		labels(_labels(i), i) = 1;
-
 	return labels;
 }
 
@@ -136,46 +329,87 @@ void MNIST::show_data(const VectorXd& data) const
 }
 
 
-CSV::CSV(const std::string& dir_name, int training_split, int validation_split) :
+CSV::CSV(const std::string& dir_name, int training_split, int validation_split,
+		bool use_cache) :
 	Data(dir_name)
 {
+	const string training_pairs_file = dir_name + "/train_data.csv";
+	const string training_labels_file = dir_name + "/train_labels.csv";
+	const string test_pairs_file = dir_name + "/test_data.csv";
+	const string test_labels_file = dir_name + "/test_labels.csv";
+
+	const string cache_file = dir_name + "/cache.bin";
+	const uint64_t key = source_key({training_pairs_file, training_labels_file,
+			test_pairs_file, test_labels_file}, training_split, validation_split);
+
+	if (use_cache && read_cache(cache_file, key)) {
+		cout << "- read from cache '" << cache_file << "'" << endl;
+		print_summary();
+		return;
+	}
+
 	/* read training data and labels */
-	MatrixXd training_pairs = read_csv(dir_name + "/train_data.csv");
-	MatrixXd training_labels = read_csv(dir_name + "/train_labels.csv");
+	int n_classes;
+	bool one_hot;
+	MatrixXd training_pairs = read_csv(training_pairs_file);
+	Labels training_labels = read_csv_labels(training_labels_file, n_classes, one_hot);
 
 	/* read test data and labels */
-	MatrixXd test_pairs = read_csv(dir_name + "/test_data.csv");
-	MatrixXd test_labels = read_csv(dir_name + "/test_labels.csv");
+	int n_test_classes;
+	bool test_one_hot;
+	MatrixXd test_pairs = read_csv(test_pairs_file);
+	Labels test_labels = read_csv_labels(test_labels_file, n_test_classes, test_one_hot);
 
 	/* determine inputs and outputs of the data set */
 	n_inputs  = training_pairs.rows();
-	n_outputs = training_labels.rows();
-	cout << "- " << n_inputs << " inputs, " << n_outputs << " outputs" << endl;
+	n_outputs = n_classes;
 
 	/* make sure the training and test data have the same layout */
 	assert(test_pairs.rows() == n_inputs);
-	assert(test_labels.rows() == n_outputs);
+	assert(test_labels.maxCoeff() < n_outputs);
+
+	/* one-hot files give the number of classes by their width */
+	assert(!(one_hot && test_one_hot) || n_test_classes == n_classes);
 
 	/* create training data */
 	training_data = make_pair(
 		training_pairs.leftCols(training_split),
 		training_labels.leftCols(training_split)
 	);
-	cout << "- " << get_n_training_sets() << " training data sets" << endl;
 
 	/* create validation data */
 	validation_data = make_pair(
 		training_pairs.rightCols(validation_split),
 		training_labels.rightCols(validation_split)
 	);
-	cout << "- " << get_n_validation_sets() << " validation data sets" << endl;
 
 	/* create test data */
 	test_data = make_pair(
 		test_pairs,
 		test_labels
 	);
-	cout << "- " << get_n_test_sets() << " test data sets" << endl << endl;
+
+	if (use_cache) {
+		if (write_cache(cache_file, key))
+			cout << "- wrote cache '" << cache_file << "'" << endl;
+		else
+			cout << "- warning: could not write cache '" << cache_file << "'" << endl;
+	}
+
+	print_summary();
+}
+
+void CSV::append(const string& data_file, const string& label_file)
+{
+	cout << "Appending data from '" << data_file << "':" << endl;
+
+	int n_classes;
+	bool one_hot;
+	Labels labels = read_csv_labels(label_file, n_classes, one_hot);
+	assert(!one_hot || n_classes == n_outputs);
+
+	append_training_sets(make_pair(read_csv(data_file), labels));
+	cout << endl;
 }
 
 void CSV::show_data(const VectorXd& data) const
@@ -218,3 +452,313 @@ MatrixXd CSV::read_csv(const std::string& file_name)
 
 	return data;
 }
+
+Data::Labels CSV::read_csv_labels(const string& file_name, int& n_classes, bool& one_hot)
+{
+	MatrixXd table = read_csv(file_name);
+
+	Labels labels(table.cols());
+
+	one_hot = (table.rows() > 1);
+
+	if (!one_hot) {
+		/* class indices, which are stored in a byte */
+		assert((table.array() == table.array().round()).all());
+		assert(table.minCoeff() >= 0.0 && table.maxCoeff() <= 255.0);
+
+		labels = table.cast<uint8_t>();
+		n_classes = labels.maxCoeff() + 1;
+	} else {
+		/* one-hot encoded, every row of the file has exactly one 1 */
+		for (int i = 0; i < (int)table.cols(); ++i) {
+			assert((table.col(i).array() == 1.0).count() == 1);
+			assert((table.col(i).array() == 0.0).count() == table.rows() - 1);
+
+			int label; table.col(i).maxCoeff(&label);
+			labels(i) = label;
+		}
+		n_classes = table.rows();
+
+		assert(n_classes <= 256);
+	}
+
+	return labels;
+}
+
+/* layout of a shard: header, followed by the inputs and the labels, each
+ * aligned to a cache line */
+struct ShardHeader {
+	char magic[8];
+	uint32_t version;
+	int32_t n_inputs;
+	int32_t n_outputs;
+	int32_t n_sets;
+};
+
+static const char shard_magic[8] = {'C', 'M', 'L', 'S', 'H', 'A', 'R', 'D'};
+static const uint32_t shard_version = 2;
+
+static void pread_all(int fd, void* data, size_t size, off_t offset)
+{
+	char* pos = (char*)data;
+
+	while (size > 0) {
+		ssize_t n = pread(fd, pos, size, offset);
+		assert(n > 0);
+
+		pos += n;
+		offset += n;
+		size -= n;
+	}
+}
+
+static ShardHeader read_shard_header(int fd)
+{
+	ShardHeader header;
+	pread_all(fd, &header, sizeof(header), 0);
+
+	assert(memcmp(header.magic, shard_magic, sizeof(shard_magic)) == 0);
+	assert(header.version == shard_version);
+
+	return header;
+}
+
+static string shard_file_name(const string& dir_name, int i)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/train-%05d.shard", i);
+	return dir_name + name;
+}
+
+Shards::Shards(const string& dir_name, int window_size) :
+	Data(dir_name), window_size{window_size}
+{
+	assert(window_size > 0);
+
+	/* only the headers of the training shards are read here */
+	struct stat st;
+	for (int i = 0; stat(shard_file_name(dir_name, i).c_str(), &st) == 0; ++i) {
+		shard_files.emplace_back(shard_file_name(dir_name, i));
+
+		int fd = open(shard_files.back().c_str(), O_RDONLY);
+		assert(fd >= 0);
+		n_training_sets += read_shard_header(fd).n_sets;
+		close(fd);
+	}
+	assert(shard_files.size() > 0);
+
+	shard_order.resize(shard_files.size());
+	iota(shard_order.begin(), shard_order.end(), 0);
+
+	validation_data = read_shard(dir_name + "/validation.shard");
+	test_data = read_shard(dir_name + "/test.shard");
+
+	/* the layout of the data is taken from the first shard */
+	int fd = open(shard_files.front().c_str(), O_RDONLY);
+	assert(fd >= 0);
+	const ShardHeader header = read_shard_header(fd);
+	close(fd);
+
+	n_inputs = header.n_inputs;
+	n_outputs = header.n_outputs;
+
+	cout << "- " << shard_files.size() << " training shards, "
+		 << window_size << " held in memory" << endl;
+
+	print_summary();
+}
+
+void Shards::write_shards(const Data& data, const string& dir_name, int sets_per_shard)
+{
+	cout << "Writing data to '" << dir_name << "':" << endl;
+
+	mkdir(dir_name.c_str(), 0755);
+
+	const Sets& training_data = data.get_training_sets();
+	const int n_sets = training_data.first.cols();
+
+	int n_shards = 0;
+	for (int i = 0; i < n_sets; i += sets_per_shard, ++n_shards) {
+		const int n = min(sets_per_shard, n_sets - i);
+
+		write_shard(shard_file_name(dir_name, n_shards), make_pair(
+			training_data.first.middleCols(i, n),
+			training_data.second.middleCols(i, n)
+		), data.get_n_outputs());
+	}
+
+	/* shards left over from an earlier, larger data set */
+	for (int i = n_shards; unlink(shard_file_name(dir_name, i).c_str()) == 0; ++i);
+
+	write_shard(dir_name + "/validation.shard", data.get_validation_sets(),
+			data.get_n_outputs());
+	write_shard(dir_name + "/test.shard", data.get_test_sets(), data.get_n_outputs());
+
+	cout << "- " << n_shards << " training shards with up to "
+		 << sets_per_shard << " sets" << endl << endl;
+}
+
+void Shards::write_shard(const string& file_name, const Sets& sets, int n_outputs)
+{
+	ofstream fout(file_name, ios::binary);
+	assert(fout.is_open());
+
+	ShardHeader header = {};
+	memcpy(header.magic, shard_magic, sizeof(shard_magic));
+	header.version = shard_version;
+	header.n_inputs = sets.first.rows();
+	header.n_outputs = n_outputs;
+	header.n_sets = sets.first.cols();
+
+	const char padding[64] = {};
+
+	auto write_aligned = [&](const char* data, size_t size) {
+		fout.write(data, size);
+		fout.write(padding, cache_aligned(size) - size);
+	};
+
+	write_aligned((const char*)&header, sizeof(header));
+	write_aligned((const char*)sets.first.data(), sets.first.size()*sizeof(double));
+	write_aligned((const char*)sets.second.data(), sets.second.size()*sizeof(uint8_t));
+
+	assert(fout.good());
+
+	fout.close();
+}
+
+Data::Sets Shards::read_shard(const string& file_name)
+{
+	int fd = open(file_name.c_str(), O_RDONLY);
+	assert(fd >= 0);
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	const ShardHeader header = read_shard_header(fd);
+
+	Sets sets = make_pair(
+		MatrixXd(header.n_inputs, header.n_sets),
+		Labels(header.n_sets)
+	);
+
+	off_t offset = cache_aligned(sizeof(header));
+	pread_all(fd, sets.first.data(), sets.first.size()*sizeof(double), offset);
+
+	offset += cache_aligned(sets.first.size()*sizeof(double));
+	pread_all(fd, sets.second.data(), sets.second.size()*sizeof(uint8_t), offset);
+
+	close(fd);
+
+	return sets;
+}
+
+void Shards::show_data(const VectorXd& data) const
+{
+	cout << "[ " << data.transpose() << " ]" << endl;
+}
+
+void Shards::shuffle_training_data()
+{
+	shard_order = rng.random_indices(shard_files.size());
+}
+
+void Shards::begin_training_batches(int batch_size)
+{
+	assert(batch_size > 0);
+
+	this->batch_size = batch_size;
+
+	/* drop what is left from the last epoch */
+	for (future<Sets>& shard : prefetch)
+		shard.wait();
+	prefetch.clear();
+
+	window = make_pair(MatrixXd(n_inputs, 0), Labels(0));
+	window_pos = 0;
+
+	next_shard = 0;
+	start_prefetch();
+}
+
+bool Shards::next_training_batch(Sets& batch)
+{
+	if (window_pos + batch_size > window.first.cols())
+		fill_window();
+
+	/* left over sets will not be included in the batches */
+	if (window_pos + batch_size > window.first.cols())
+		return false;
+
+	batch.first = window.first.middleCols(window_pos, batch_size);
+	batch.second = window.second.middleCols(window_pos, batch_size);
+
+	window_pos += batch_size;
+
+	return true;
+}
+
+const vector<Data::Sets> Shards::get_training_batches(int) const
+{
+	assert(false);
+	return {};
+}
+
+const Data::Sets& Shards::get_training_sets() const
+{
+	assert(false);
+	return training_data;
+}
+
+void Shards::append_training_sets(const Sets&)
+{
+	assert(false);
+}
+
+Data::Sets Shards::get_incremental_sets(double) const
+{
+	assert(false);
+	return Sets();
+}
+
+void Shards::start_prefetch()
+{
+	while ((int)prefetch.size() < window_size && next_shard < (int)shard_files.size())
+		prefetch.emplace_back(async(launch::async, read_shard,
+			shard_files[shard_order[next_shard++]]));
+}
+
+void Shards::fill_window()
+{
+	/* the sets of the window that have not been used yet */
+	vector<Sets> parts;
+	parts.emplace_back(
+		window.first.rightCols(window.first.cols() - window_pos),
+		window.second.rightCols(window.second.cols() - window_pos)
+	);
+
+	/* the whole window has been prefetched, so this only waits if the
+	 * training on the last window was faster than reading this one */
+	for (int i = 0; i < window_size && !prefetch.empty(); ++i) {
+		parts.emplace_back(prefetch.front().get());
+		prefetch.pop_front();
+	}
+
+	start_prefetch();
+
+	int n_sets = 0;
+	for (const Sets& part : parts)
+		n_sets += part.first.cols();
+
+	/* shuffle the sets within the window */
+	vector<int> idx = rng.random_indices(n_sets);
+
+	window = make_pair(MatrixXd(n_inputs, n_sets), Labels(n_sets));
+	window_pos = 0;
+
+	int k = 0;
+	for (const Sets& part : parts) {
+		for (int j = 0; j < part.first.cols(); ++j, ++k) {
+			window.first.col(idx[k]) = part.first.col(j);
+			window.second(idx[k]) = part.second(j);
+		}
+	}
+}
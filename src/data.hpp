@@ -2,7 +2,12 @@
 #define DATA_HPP
 
 #include <string>
+#include <cassert>
+#include <algorithm>
 #include <vector>
+#include <cstdint>
+#include <deque>
+#include <future>
 #include <fstream>
 #include <iostream>
 #include <Eigen/Dense>
@@ -13,32 +18,67 @@ class Data {
 		using VectorXd = Eigen::VectorXd;
 		using MatrixXd = Eigen::MatrixXd;
 
-		using Sets = std::pair<MatrixXd, MatrixXd>;
+		/* labels are stored as class indices, the output of the network for
+		 * a set is expected to be largest in the row of its class */
+		using Labels = Eigen::Matrix<uint8_t, 1, Eigen::Dynamic>;
+
+		using Sets = std::pair<MatrixXd, Labels>;
 
 		Data(const std::string& dir_name) {
 			std::cout << "Reading data from '" << dir_name << "':" << std::endl;
 		}
 
+		virtual ~Data() = default;
+
 		virtual void show_data(const VectorXd& data) const = 0;
 
-		void shuffle_training_data() {
+		/* the new sets are mixed into the old ones, so they are committed */
+		virtual void shuffle_training_data() {
+			commit_training_sets();
+
 			std::vector<int> idx = rng.random_indices(get_n_training_sets());
 			Sets training_data_copy = training_data;
 			for (int i = 0; i < get_n_training_sets(); ++i) {
 				training_data.first.col(i) = training_data_copy.first.col(idx[i]);
-				training_data.second.col(i) = training_data_copy.second.col(idx[i]);
+				training_data.second(i) = training_data_copy.second(idx[i]);
 			}
 		}
 
-		const std::vector<Sets> get_training_batches(int batch_size) const {
+		virtual const std::vector<Sets> get_training_batches(int batch_size) const {
+			return make_batches(training_data, batch_size);
+		}
+
+		/* the batches of an epoch are read one after another, so data sets
+		 * that are not held in memory can stream them */
+		virtual void begin_training_batches(int batch_size) {
+			assert(batch_size > 0);
+
+			this->batch_size = batch_size;
+			batch_pos = 0;
+		}
+
+		virtual bool next_training_batch(Sets& batch) {
+			/* left over sets will not be included in the batches */
+			if (batch_pos + batch_size > get_n_training_sets())
+				return false;
+
+			batch.first = training_data.first.middleCols(batch_pos, batch_size);
+			batch.second = training_data.second.middleCols(batch_pos, batch_size);
+
+			batch_pos += batch_size;
+
+			return true;
+		}
+
+		static std::vector<Sets> make_batches(const Sets& sets, int batch_size) {
 			std::vector<Sets> batches;
 
 			int i = 0;
 
-			while (i + batch_size <= get_n_training_sets()) {
+			while (i + batch_size <= sets.first.cols()) {
 				Sets batch = std::make_pair(
-					training_data.first.middleCols(i, batch_size),
-					training_data.second.middleCols(i, batch_size)
+					sets.first.middleCols(i, batch_size),
+					sets.second.middleCols(i, batch_size)
 				);
 
 				batches.emplace_back(batch);
@@ -51,7 +91,54 @@ class Data {
 			return batches;
 		}
 
-		const Sets& get_training_sets() const {
+		/* add sets to the training data, they are also kept apart as new sets
+		 * until commit_training_sets() is called */
+		virtual void append_training_sets(const Sets& sets) {
+			assert(sets.first.rows() == n_inputs);
+			assert(sets.second.size() == 0 || sets.second.maxCoeff() < n_outputs);
+			assert(sets.first.cols() == sets.second.cols());
+
+			append_cols(training_data.first, sets.first);
+			append_cols(training_data.second, sets.second);
+
+			append_cols(new_training_data.first, sets.first);
+			append_cols(new_training_data.second, sets.second);
+
+			std::cout << "- " << sets.first.cols() << " training data sets appended, "
+				<< get_n_training_sets() << " in total" << std::endl;
+		}
+
+		void commit_training_sets() {
+			new_training_data = Sets();
+		}
+
+		/* shuffled mix of all new sets and replay_ratio times as many sets
+		 * drawn from the old training data, which are the leading columns
+		 * as long as the new sets have not been committed */
+		virtual Sets get_incremental_sets(double replay_ratio) const {
+			const int n_new = get_n_new_training_sets();
+			const int n_old = get_n_training_sets() - n_new;
+			const int n_replay = std::min((int)(replay_ratio*n_new), n_old);
+
+			std::vector<int> idx_replay = rng.random_indices(n_old);
+			std::vector<int> idx = rng.random_indices(n_new + n_replay);
+
+			Sets sets = std::make_pair(
+				MatrixXd(n_inputs, n_new + n_replay),
+				Labels(n_new + n_replay)
+			);
+
+			for (int i = 0; i < n_new + n_replay; ++i) {
+				const Sets& src = (idx[i] < n_new ? new_training_data : training_data);
+				const int j = (idx[i] < n_new ? idx[i] : idx_replay[idx[i] - n_new]);
+				sets.first.col(i) = src.first.col(j);
+				sets.second(i) = src.second(j);
+			}
+
+			return sets;
+		}
+
+		virtual const Sets& get_training_sets() const {
 			return training_data;
 		}
 
@@ -67,43 +154,147 @@ class Data {
 
 		int get_n_outputs() const { return n_outputs; }
 
-		int get_n_training_sets() const { return training_data.first.cols(); }
+		virtual int get_n_training_sets() const { return training_data.first.cols(); }
 
 		int get_n_validation_sets() const { return validation_data.first.cols(); }
 
 		int get_n_test_sets() const { return test_data.first.cols(); }
 
+		int get_n_new_training_sets() const { return new_training_data.first.cols(); }
+
 	protected:
+		/* binary cache of the processed data, valid as long as the key
+		 * matches the one it was written with */
+		bool read_cache(const std::string& file_name, uint64_t key);
+
+		/* returns false if the cache could not be written */
+		bool write_cache(const std::string& file_name, uint64_t key) const;
+
+		/* key from the size and modification time of the source files */
+		static uint64_t source_key(const std::vector<std::string>& file_names,
+				int training_split, int validation_split);
+
+		void print_summary() const;
+
 		Sets training_data;
+		Sets new_training_data;
 		Sets validation_data;
 		Sets test_data;
 
 		int n_inputs;
 		int n_outputs;
+
+		int batch_size = 0;
+		int batch_pos = 0;
+
+	private:
+		template <typename Matrix>
+		static void append_cols(Matrix& m, const Matrix& cols) {
+			if (m.size() == 0) {
+				m = cols;
+			} else {
+				m.conservativeResize(Eigen::NoChange, m.cols() + cols.cols());
+				m.rightCols(cols.cols()) = cols;
+			}
+		}
 };
 
 class MNIST : public Data {
 	public:
-		MNIST(const std::string& dir_name, int training_split, int validation_split);
+		MNIST(const std::string& dir_name, int training_split, int validation_split,
+				bool use_cache = false);
 
 		void show_data(const VectorXd& data) const override;
 
+		/* append new training images and labels */
+		void append(const std::string& image_file, const std::string& label_file);
+
 	private:
 		uint32_t reverse_int(uint32_t& n);
 
 		MatrixXd read_mnist_images(const std::string& file_name);
 
-		MatrixXd read_mnist_labels(const std::string& file_name);
+		Labels read_mnist_labels(const std::string& file_name);
 };
 
 class CSV : public Data {
 	public:
-		CSV(const std::string& dir_name, int training_split, int validation_split);
+		CSV(const std::string& dir_name, int training_split, int validation_split,
+				bool use_cache = false);
 
 		void show_data(const VectorXd& data) const override;
 
+		/* append new training data and labels */
+		void append(const std::string& data_file, const std::string& label_file);
+
 	private:
 		MatrixXd read_csv(const std::string& file_name);
+
+		/* labels either as one class index per line or one-hot encoded; the
+		 * number of classes is the width of a one-hot file, otherwise the
+		 * largest class index plus one */
+		Labels read_csv_labels(const std::string& file_name, int& n_classes,
+				bool& one_hot);
+};
+
+/* training data split into shards on disk, of which only a window of
+ * shards is held in memory at a time, while the next window is read in
+ * the background; the sets are shuffled within the window and the order
+ * of the shards is shuffled every epoch, the validation and test data
+ * are held in memory */
+class Shards : public Data {
+	public:
+		Shards(const std::string& dir_name, int window_size = 4);
+
+		/* write the data sets of data to dir_name, with sets_per_shard
+		 * training sets per shard */
+		static void write_shards(const Data& data, const std::string& dir_name,
+				int sets_per_shard);
+
+		void show_data(const VectorXd& data) const override;
+
+		void shuffle_training_data() override;
+
+		void begin_training_batches(int batch_size) override;
+
+		bool next_training_batch(Sets& batch) override;
+
+		int get_n_training_sets() const override { return n_training_sets; }
+
+		/* the training sets are not held in memory, they can only be read
+		 * batch by batch */
+		const std::vector<Sets> get_training_batches(int batch_size) const override;
+
+		const Sets& get_training_sets() const override;
+
+		void append_training_sets(const Sets& sets) override;
+
+		Sets get_incremental_sets(double replay_ratio) const override;
+
+	private:
+		int window_size;
+		int n_training_sets = 0;
+
+		std::vector<std::string> shard_files;
+		std::vector<int> shard_order;
+		int next_shard = 0;
+
+		Sets window;
+		int window_pos = 0;
+
+		/* the shards of the next window are read while training on the
+		 * current one */
+		std::deque<std::future<Sets>> prefetch;
+
+		/* start reading shards until window_size of them are in flight */
+		void start_prefetch();
+
+		void fill_window();
+
+		static void write_shard(const std::string& file_name, const Sets& sets,
+				int n_outputs);
+
+		static Sets read_shard(const std::string& file_name);
 };
 
 #endif
@@ -1,8 +1,306 @@
 #include "network.hpp"
 
+#include <thread>
+#include <sstream>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 using namespace std;
 using namespace Eigen;
 
+int Layer::tile_bytes = 1 << 20;
+
+double Layer::max_sparse_density = 0.2;
+
+int Layer::tile_size() const
+{
+	/* a tile holds the output and the stored z or output */
+	return max(1, tile_bytes/(int)(2*n_outputs*sizeof(double)));
+}
+
+MatrixXd Layer::feed_forward(const MatrixXd& a_in, bool training)
+{
+	const int n_cols = a_in.cols();
+	const int tile = tile_size();
+
+	MatrixXd a_out(n_outputs, n_cols);
+
+	if (training) {
+		this->a_in = a_in;
+		z.resize(n_outputs, n_cols);
+	}
+
+	for (int j = 0; j < n_cols; j += tile) {
+		const int n = min(tile, n_cols - j);
+		auto a_tile = a_out.middleCols(j, n);
+
+		/* matrix product with bias and activation as epilogue */
+		if (sparse)
+			sparse_feed_forward(a_in.middleCols(j, n), a_tile);
+		else
+			a_tile.noalias() = W*a_in.middleCols(j, n);
+		a_tile.colwise() += b;
+
+		/* keep z, or the output if the derivative can be computed from it */
+		if (training && !sigma->has_output_deriv())
+			z.middleCols(j, n) = a_tile;
+
+		sigma->eval(a_tile);
+
+		if (training && sigma->has_output_deriv())
+			z.middleCols(j, n) = a_tile;
+	}
+
+	return a_out;
+}
+
+void Layer::sparse_feed_forward(const Ref<const MatrixXd>& a_in, Ref<MatrixXd> a_out)
+{
+	const int n_cols = a_in.cols();
+
+	/* transposed, so the input row picked by a nonzero weight is contiguous
+	 * and every nonzero becomes a vectorized axpy over the batch */
+	const MatrixXd a_in_t = a_in.transpose();
+	MatrixXd a_out_t(n_cols, n_outputs);
+
+	const int* row_start = W_sparse.outerIndexPtr();
+	const int* col_index = W_sparse.innerIndexPtr();
+	const double* values = W_sparse.valuePtr();
+
+	#pragma omp parallel for if((int64_t)W_sparse.nonZeros()*n_cols > (1 << 20))
+	for (int i = 0; i < n_outputs; ++i) {
+		auto out = a_out_t.col(i);
+		out.setZero();
+		for (int k = row_start[i]; k < row_start[i + 1]; ++k)
+			out += values[k]*a_in_t.col(col_index[k]);
+	}
+
+	a_out = a_out_t.transpose();
+}
+
+void Layer::prune(double sparsity)
+{
+	assert(sparsity >= 0.0 && sparsity < 1.0);
+
+	const MatrixXd W_dense = get_weights();
+
+	/* the smallest magnitude that is kept */
+	const int n_pruned = sparsity*W_dense.size();
+	vector<double> magnitudes(W_dense.size());
+	Map<MatrixXd>(magnitudes.data(), W_dense.rows(), W_dense.cols()) = W_dense.cwiseAbs();
+	nth_element(magnitudes.begin(), magnitudes.begin() + n_pruned, magnitudes.end());
+	const double threshold = magnitudes[n_pruned];
+
+	/* weights pruned before stay pruned */
+	vector<Triplet<double>> kept;
+	if (pruned) {
+		const SparseMatrixXd W_kept = get_sparse_weights();
+		for (int i = 0; i < n_outputs; ++i)
+			for (SparseMatrixXd::InnerIterator it(W_kept, i); it; ++it)
+				if (abs(it.value()) >= threshold)
+					kept.emplace_back(i, it.col(), it.value());
+	} else {
+		for (int i = 0; i < n_outputs; ++i)
+			for (int j = 0; j < n_inputs; ++j)
+				if (abs(W_dense(i, j)) >= threshold)
+					kept.emplace_back(i, j, W_dense(i, j));
+	}
+
+	SparseMatrixXd W_kept(n_outputs, n_inputs);
+	W_kept.setFromTriplets(kept.begin(), kept.end());
+
+	set_pruned(W_kept);
+}
+
+void Layer::set_pruned(const SparseMatrixXd& W_kept)
+{
+	pruned = true;
+	sparse = W_kept.nonZeros() <= max_sparse_density*n_outputs*n_inputs;
+
+	if (sparse) {
+		W_sparse = W_kept;
+		W_sparse.makeCompressed();
+
+		W.resize(0, 0);
+		W_mask.resize(0, 0);
+	} else {
+		W = W_kept;
+
+		W_mask = MatrixXb::Zero(n_outputs, n_inputs);
+		for (int i = 0; i < n_outputs; ++i)
+			for (SparseMatrixXd::InnerIterator it(W_kept, i); it; ++it)
+				W_mask(i, it.col()) = true;
+
+		W_sparse = SparseMatrixXd();
+	}
+}
+
+Layer::SparseMatrixXd Layer::get_sparse_weights() const
+{
+	assert(pruned);
+
+	if (sparse)
+		return W_sparse;
+
+	vector<Triplet<double>> kept;
+	for (int i = 0; i < n_outputs; ++i)
+		for (int j = 0; j < n_inputs; ++j)
+			if (W_mask(i, j))
+				kept.emplace_back(i, j, W(i, j));
+
+	SparseMatrixXd W_kept(n_outputs, n_inputs);
+	W_kept.setFromTriplets(kept.begin(), kept.end());
+	W_kept.makeCompressed();
+
+	return W_kept;
+}
+
+double Layer::get_sparsity() const
+{
+	if (sparse)
+		return 1.0 - (double)W_sparse.nonZeros()/((int64_t)n_outputs*n_inputs);
+
+	if (pruned)
+		return 1.0 - (double)W_mask.count()/W_mask.size();
+
+	return 1.0 - (double)(W.array() != 0.0).count()/W.size();
+}
+
+void Layer::save(ostream& out) const
+{
+	out.write((char*)&n_inputs, sizeof(n_inputs));
+	out.write((char*)&n_outputs, sizeof(n_outputs));
+
+	const int csr = pruned;
+	out.write((char*)&csr, sizeof(csr));
+
+	if (csr) {
+		const SparseMatrixXd W_kept = get_sparse_weights();
+		const int nnz = W_kept.nonZeros();
+		out.write((char*)&nnz, sizeof(nnz));
+		out.write((char*)W_kept.outerIndexPtr(), (n_outputs + 1)*sizeof(int));
+		out.write((char*)W_kept.innerIndexPtr(), nnz*sizeof(int));
+		out.write((char*)W_kept.valuePtr(), nnz*sizeof(double));
+	} else {
+		out.write((char*)W.data(), W.size()*sizeof(double));
+	}
+
+	out.write((char*)b.data(), b.size()*sizeof(double));
+}
+
+void Layer::load(istream& in)
+{
+	int _n_inputs, _n_outputs;
+	in.read((char*)&_n_inputs, sizeof(_n_inputs));
+	in.read((char*)&_n_outputs, sizeof(_n_outputs));
+
+	/* the layout of the stored layer has to match */
+	assert(_n_inputs == n_inputs);
+	assert(_n_outputs == n_outputs);
+
+	int csr;
+	in.read((char*)&csr, sizeof(csr));
+
+	if (csr) {
+		int nnz;
+		in.read((char*)&nnz, sizeof(nnz));
+		assert(nnz >= 0 && nnz <= (int64_t)n_outputs*n_inputs);
+
+		SparseMatrixXd W_kept(n_outputs, n_inputs);
+		W_kept.resizeNonZeros(nnz);
+		in.read((char*)W_kept.outerIndexPtr(), (n_outputs + 1)*sizeof(int));
+		in.read((char*)W_kept.innerIndexPtr(), nnz*sizeof(int));
+		in.read((char*)W_kept.valuePtr(), nnz*sizeof(double));
+
+		const int* row_start = W_kept.outerIndexPtr();
+		const int* col_index = W_kept.innerIndexPtr();
+		assert(row_start[0] == 0 && row_start[n_outputs] == nnz);
+		for (int i = 0; i < n_outputs; ++i)
+			assert(row_start[i] <= row_start[i + 1]);
+		for (int k = 0; k < nnz; ++k)
+			assert(col_index[k] >= 0 && col_index[k] < n_inputs);
+
+		set_pruned(W_kept);
+	} else {
+		W.resize(n_outputs, n_inputs);
+		in.read((char*)W.data(), W.size()*sizeof(double));
+
+		W_mask.resize(0, 0);
+		W_sparse = SparseMatrixXd();
+		pruned = false;
+		sparse = false;
+	}
+
+	in.read((char*)b.data(), b.size()*sizeof(double));
+	assert(in.good());
+}
+
+MatrixXd Layer::feed_backward(const MatrixXd& dC_da_out, double alpha, double lambda,
+		double n)
+{
+	const int n_cols = dC_da_out.cols();
+	const int tile = tile_size();
+
+	MatrixXd dC_da_in(n_inputs, n_cols);
+	MatrixXd dC_dW = MatrixXd::Zero(n_outputs, (sparse ? 0 : n_inputs));
+	VectorXd dC_db = VectorXd::Zero(n_outputs);
+
+	for (int j = 0; j < n_cols; j += tile) {
+		const int n = min(tile, n_cols - j);
+
+		/* delta overwrites z, it is not needed after the back propagation */
+		auto delta = z.middleCols(j, n);
+		if (sigma->has_output_deriv())
+			sigma->output_deriv(delta);
+		else
+			sigma->deriv(delta);
+		delta.array() *= dC_da_out.middleCols(j, n).array();
+
+		if (sparse) {
+			dC_da_in.middleCols(j, n).noalias() = W_sparse.transpose()*delta;
+		} else {
+			dC_da_in.middleCols(j, n).noalias() = W.transpose()*delta;
+			dC_dW.noalias() += delta*a_in.middleCols(j, n).transpose();
+		}
+		dC_db += delta.rowwise().sum();
+	}
+
+	if (sparse) {
+		sparse_update(alpha/n_cols, alpha*lambda/n);
+	} else {
+		W -= alpha/n_cols*dC_dW + alpha*lambda/n*W;
+
+		/* keep pruned weights at zero */
+		if (pruned)
+			W = W_mask.select(W, 0.0);
+	}
+	b -= alpha/n_cols*dC_db;
+
+	return dC_da_in;
+}
+
+void Layer::sparse_update(double step, double decay)
+{
+	const int n_cols = z.cols();
+
+	/* only the gradients of the kept weights are computed, each one is the
+	 * dot product of a row of delta and a row of the input */
+	const MatrixXd delta_t = z.transpose();
+	const MatrixXd a_in_t = a_in.transpose();
+
+	const int* row_start = W_sparse.outerIndexPtr();
+	const int* col_index = W_sparse.innerIndexPtr();
+	double* values = W_sparse.valuePtr();
+
+	#pragma omp parallel for if((int64_t)W_sparse.nonZeros()*n_cols > (1 << 20))
+	for (int i = 0; i < n_outputs; ++i)
+		for (int k = row_start[i]; k < row_start[i + 1]; ++k)
+			values[k] -= step*delta_t.col(i).dot(a_in_t.col(col_index[k]))
+				+ decay*values[k];
+}
+
 Network::Network(Data& data, vector<Layer>& layers) :
 	data{data}, layers{layers}
 {
@@ -31,13 +329,65 @@ Network::Network(Data& data, vector<Layer>& layers) :
 void Network::train(double alpha, int epochs, int batch_size, shared_ptr<Cost> cost,
 		double lambda, bool do_validation_inbetween, bool do_tests_inbetween)
 {
-	ofstream fout("history.csv");
-	assert(fout.is_open());
+	cout << "Training neural network on " << data.get_n_training_sets() << " sets with "
+		 << cost->get_name() << " cost:" << endl;
 
-	int n_training_sets = data.get_n_training_sets();
+	_train(alpha, epochs, cost, lambda, do_validation_inbetween, do_tests_inbetween,
+		[&]() {
+			/* randomize training data */
+			data.shuffle_training_data();
 
-	cout << "Training neural network on " << n_training_sets << " sets with "
-		 << cost->get_name() << " cost:" << endl;
+			data.begin_training_batches(batch_size);
+		},
+		[&](Data::Sets& batch) {
+			return data.next_training_batch(batch);
+		});
+}
+
+void Network::train_incremental(double alpha, int epochs, int batch_size,
+		shared_ptr<Cost> cost, double lambda, double replay_ratio,
+		bool do_validation_inbetween, bool do_tests_inbetween)
+{
+	/* the replayed sets alone are not worth an epoch */
+	if (data.get_n_new_training_sets() < batch_size) {
+		cout << "Not enough new sets for incremental training: "
+			 << data.get_n_new_training_sets() << " sets, batch size "
+			 << batch_size << endl << endl;
+		return;
+	}
+
+	cout << "Continuing training of neural network on "
+		 << data.get_n_new_training_sets() << " new sets with a replay ratio of "
+		 << replay_ratio << " and " << cost->get_name() << " cost:" << endl;
+
+	vector<Data::Sets> batches;
+	size_t i_batch = 0;
+
+	_train(alpha, epochs, cost, lambda, do_validation_inbetween, do_tests_inbetween,
+		[&]() {
+			batches = Data::make_batches(data.get_incremental_sets(replay_ratio), batch_size);
+			i_batch = 0;
+		},
+		[&](Data::Sets& batch) {
+			if (i_batch == batches.size())
+				return false;
+
+			batch = batches[i_batch++];
+
+			return true;
+		});
+
+	/* the new sets are part of the regular training data from now on */
+	data.commit_training_sets();
+}
+
+void Network::_train(double alpha, int epochs, shared_ptr<Cost> cost, double lambda,
+		bool do_validation_inbetween, bool do_tests_inbetween,
+		const function<void()>& begin_epoch,
+		const function<bool(Data::Sets&)>& next_batch)
+{
+	ofstream fout("history.csv");
+	assert(fout.is_open());
 
 	cout << "Epoch     Training      Validation        Test" << endl;
 
@@ -48,17 +398,15 @@ void Network::train(double alpha, int epochs, int batch_size, shared_ptr<Cost> c
 
 	for (int epoch = 0; epoch < epochs; ++epoch) {
 
-		/* randomize training data */
-		data.shuffle_training_data();
-
-		/* get the training batches */
-		const vector<Data::Sets> batches = data.get_training_batches(batch_size);
+		begin_epoch();
 
+		int n_sets = 0;
 		int n_correct = 0;
 		double C_mean = 0;
 
 		/* perform stochastic gradient descent */
-		for(const Data::Sets& batch : batches) {
+		Data::Sets batch;
+		while (next_batch(batch)) {
 
 			MatrixXd a = batch.first;
 
@@ -67,12 +415,9 @@ void Network::train(double alpha, int epochs, int batch_size, shared_ptr<Cost> c
 				a = layers[l].feed_forward(a);
 
 			/* check if outputs are correct */
-			for (int i = 0; i < (int)batch.first.cols(); ++i) {
-				int prediction; a.col(i).maxCoeff(&prediction);
-				int label; batch.second.col(i).maxCoeff(&label);
-				if (prediction == label)
-					++n_correct;
-			}
+			n_correct += _count_correct(a, batch.second);
+
+			n_sets += batch.first.cols();
 
 			/* add up cost */
 			C_mean += cost->eval(a, batch.second);
@@ -86,15 +431,18 @@ void Network::train(double alpha, int epochs, int batch_size, shared_ptr<Cost> c
 						data.get_n_training_sets());
 		}
 
+		/* there has to be at least one batch */
+		assert(n_sets > 0);
+
 		cout << setw((int)log10(epochs) + 1) << epoch + 1
 			 << "/" << epochs << fixed << setprecision(2);
 
-		cout << "   " << 100.0*n_correct/data.get_n_training_sets()
-			 << "%  " << C_mean/data.get_n_training_sets();
+		cout << "   " << 100.0*n_correct/n_sets
+			 << "%  " << C_mean/n_sets;
 
 		fout << epoch << ","
-			 << n_correct/(double)data.get_n_training_sets() << ","
-			 << C_mean/data.get_n_training_sets();
+			 << n_correct/(double)n_sets << ","
+			 << C_mean/n_sets;
 
 		if (do_validation_inbetween)
 			_validate(cost, fout);
@@ -111,6 +459,222 @@ void Network::train(double alpha, int epochs, int batch_size, shared_ptr<Cost> c
 	cout << endl;
 }
 
+void Network::save(const string& file_name) const
+{
+	ofstream fout(file_name, ios::binary);
+	assert(fout.is_open());
+
+	int n_layers = layers.size();
+	fout.write((char*)&n_layers, sizeof(n_layers));
+
+	for (const Layer& layer : layers)
+		layer.save(fout);
+
+	fout.close();
+
+	cout << "Saved neural network to '" << file_name << "'" << endl << endl;
+}
+
+void Network::load(const string& file_name)
+{
+	ifstream fin(file_name, ios::binary);
+	assert(fin.is_open());
+
+	int n_layers;
+	fin.read((char*)&n_layers, sizeof(n_layers));
+	assert(n_layers == (int)layers.size());
+
+	for (Layer& layer : layers)
+		layer.load(fin);
+
+	fin.close();
+
+	cout << "Loaded neural network from '" << file_name << "'" << endl << endl;
+}
+
+TrainingConfig Network::autotune(int min_batch_size, int max_batch_size,
+		const string& cache_file, double trial_time)
+{
+	assert(min_batch_size > 0 && min_batch_size <= max_batch_size);
+
+	/* every trial has to complete at least one batch */
+	max_batch_size = min(max_batch_size, data.get_n_training_sets());
+	min_batch_size = min(min_batch_size, max_batch_size);
+	assert(min_batch_size > 0);
+
+	/* the configuration depends on the machine and the layout of the network */
+	char hostname[256] = {};
+	gethostname(hostname, sizeof(hostname) - 1);
+
+	stringstream key_ss;
+	key_ss << hostname << "/" << thread::hardware_concurrency() << "/" << layers[0].n_inputs;
+	for (const Layer& layer : layers)
+		key_ss << "-" << layer.n_outputs;
+	key_ss << "/" << min_batch_size << "-" << max_batch_size;
+	const string key = key_ss.str();
+
+	TrainingConfig best = {};
+
+	auto apply = [&](const TrainingConfig& config) {
+		Eigen::setNbThreads(config.n_threads);
+#ifdef _OPENMP
+		omp_set_num_threads(config.n_threads);
+#endif
+		Layer::tile_bytes = config.tile_bytes;
+
+		cout << "- batch size " << config.batch_size << ", "
+			 << config.n_threads << " threads, "
+			 << (config.tile_bytes >> 10) << " KiB tiles, "
+			 << lround(config.samples_per_second) << " sets/s"
+			 << endl << endl;
+	};
+
+	/* look for a cached configuration */
+	ifstream fin(cache_file);
+	string line;
+	while (getline(fin, line)) {
+		stringstream line_ss(line);
+		string cell;
+		getline(line_ss, cell, ',');
+
+		if (cell == key) {
+			char sep;
+			line_ss >> best.batch_size >> sep >> best.n_threads >> sep
+				>> best.tile_bytes >> sep >> best.samples_per_second;
+
+			/* skip broken entries */
+			if (!line_ss || best.batch_size <= 0 || best.n_threads <= 0
+					|| best.tile_bytes <= 0 || best.samples_per_second <= 0.0) {
+				best = {};
+				continue;
+			}
+
+			cout << "Read training configuration from '" << cache_file << "':" << endl;
+			apply(best);
+			return best;
+		}
+	}
+	fin.close();
+
+	cout << "Tuning training configuration:" << endl;
+
+	/* all processors, not the current thread limit which might have been
+	 * lowered by an earlier call */
+	int max_threads = max(1u, thread::hardware_concurrency());
+#ifdef _OPENMP
+	max_threads = omp_get_num_procs();
+#endif
+
+	vector<int> batch_sizes = {min_batch_size};
+	for (int n = 2*min_batch_size; n < max_batch_size; n *= 2)
+		batch_sizes.emplace_back(n);
+	if (max_batch_size > min_batch_size)
+		batch_sizes.emplace_back(max_batch_size);
+
+	vector<int> n_threads = {1};
+	for (int n = 2; n < max_threads; n *= 2)
+		n_threads.emplace_back(n);
+	if (max_threads > 1)
+		n_threads.emplace_back(max_threads);
+
+	const int default_tile_bytes = Layer::tile_bytes;
+
+	/* untimed warm-up, so the first trial does not pay for starting the
+	 * threads and the first touch of the memory */
+	Eigen::setNbThreads(max_threads);
+#ifdef _OPENMP
+	omp_set_num_threads(max_threads);
+#endif
+	_time_training(batch_sizes.back(), trial_time);
+
+	for (int tile_bytes : {default_tile_bytes/4, default_tile_bytes, 4*default_tile_bytes}) {
+		for (int n : n_threads) {
+			for (int batch_size : batch_sizes) {
+				TrainingConfig config = {batch_size, n, tile_bytes, 0.0};
+
+				Eigen::setNbThreads(n);
+#ifdef _OPENMP
+				omp_set_num_threads(n);
+#endif
+				Layer::tile_bytes = tile_bytes;
+
+				config.samples_per_second = _time_training(batch_size, trial_time);
+
+				if (config.samples_per_second > best.samples_per_second)
+					best = config;
+			}
+		}
+	}
+
+	assert(best.samples_per_second > 0.0);
+
+	apply(best);
+
+	ofstream fout(cache_file, ios::app);
+	assert(fout.is_open());
+	fout << key << "," << best.batch_size << "," << best.n_threads << ","
+		 << best.tile_bytes << "," << best.samples_per_second << endl;
+	fout.close();
+
+	return best;
+}
+
+double Network::_time_training(int batch_size, double trial_time)
+{
+	data.begin_training_batches(batch_size);
+
+	Data::Sets batch;
+	int n_sets = 0;
+
+	auto wtime_start = chrono::high_resolution_clock::now();
+	chrono::duration<double> wtime_delta(0.0);
+
+	/* with a zero learning rate and regularization the weights stay unchanged */
+	while (wtime_delta.count() < trial_time && data.next_training_batch(batch)) {
+		MatrixXd a = batch.first;
+
+		for (int l = 0; l < (int)layers.size(); ++l)
+			a = layers[l].feed_forward(a);
+
+		MatrixXd dC_da_out = MSE().deriv(a, batch.second);
+
+		for (int l = (int)layers.size() - 1; l >= 0; --l)
+			dC_da_out = layers[l].feed_backward(dC_da_out, 0.0, 0.0, 1.0);
+
+		n_sets += batch_size;
+		wtime_delta = chrono::high_resolution_clock::now() - wtime_start;
+	}
+
+	/* not enough training data for a single batch */
+	if (n_sets == 0)
+		return 0.0;
+
+	return n_sets/wtime_delta.count();
+}
+
+Data::Labels Network::_predict(const MatrixXd& a)
+{
+	/* transposed, so the outputs of one class are contiguous and the
+	 * comparisons are vectorized over the sets */
+	const MatrixXd a_t = a.transpose();
+
+	Data::Labels prediction = Data::Labels::Zero(a.cols());
+	VectorXd a_max = a_t.col(0);
+
+	for (int k = 1; k < a_t.cols(); ++k) {
+		const auto greater = (a_t.col(k).array() > a_max.array()).transpose();
+		prediction = greater.select(Data::Labels::Constant(a.cols(), k), prediction);
+		a_max = a_max.cwiseMax(a_t.col(k));
+	}
+
+	return prediction;
+}
+
+int Network::_count_correct(const MatrixXd& a, const Data::Labels& labels)
+{
+	return (_predict(a).array() == labels.array()).count();
+}
+
 void Network::_validate(std::shared_ptr<Cost> cost, std::ofstream& fout) const
 {
 	const Data::Sets validation_data = data.get_validation_sets();
@@ -122,15 +686,10 @@ void Network::_validate(std::shared_ptr<Cost> cost, std::ofstream& fout) const
 
 	/* feed forward */
 	for (int l = 0; l < (int)layers.size(); ++l)
-		a = layers[l].feed_forward(a);
+		a = layers[l].feed_forward(a, false);
 
 	/* check if output is correct */
-	for (int i = 0; i < data.get_n_test_sets(); ++i) {
-		int prediction; a.col(i).maxCoeff(&prediction);
-		int label; validation_data.second.col(i).maxCoeff(&label);
-		if (prediction == label)
-			++n_correct;
-	}
+	n_correct += _count_correct(a, validation_data.second);
 
 	/* add up cost */
 	C_mean += cost->eval(a, validation_data.second);
@@ -154,15 +713,10 @@ void Network::_test(std::shared_ptr<Cost> cost, std::ofstream& fout) const
 
 	/* feed forward */
 	for (int l = 0; l < (int)layers.size(); ++l)
-		a = layers[l].feed_forward(a);
+		a = layers[l].feed_forward(a, false);
 
 	/* check if output is correct */
-	for (int i = 0; i < data.get_n_test_sets(); ++i) {
-		int prediction; a.col(i).maxCoeff(&prediction);
-		int label; test_data.second.col(i).maxCoeff(&label);
-		if (prediction == label)
-			++n_correct;
-	}
+	n_correct += _count_correct(a, test_data.second);
 
 	/* add up cost */
 	C_mean += cost->eval(a, test_data.second);
@@ -192,12 +746,13 @@ void Network::test(int n_incorrect, const std::map<int, std::string>& map) const
 
 	/* feed forward */
 	for (int l = 0; l < (int)layers.size(); ++l)
-		a = layers[l].feed_forward(a);
+		a = layers[l].feed_forward(a, false);
 
 	/* check if output is correct */
+	const Data::Labels predictions = _predict(a);
 	for (int i = 0; i < data.get_n_test_sets(); ++i) {
-		int prediction; a.col(i).maxCoeff(&prediction);
-		int label; test_data.second.col(i).maxCoeff(&label);
+		int prediction = predictions(i);
+		int label = test_data.second(i);
 		if (prediction == label) {
 			++n_correct;
 		} else {
@@ -232,3 +787,210 @@ void Network::test(int n_incorrect, const std::map<int, std::string>& map) const
 		}
 	}
 }
+
+void Network::export_header(const string& file_name, const string& name) const
+{
+	ofstream fout(file_name);
+	assert(fout.is_open());
+
+	/* the activation functions in plain c++, the fast ones use the same
+	 * approximations as the library */
+	const map<string, string> activations = {
+		{"Sigmoid", "1.0/(1.0 + std::exp(-x))"},
+		{"TanH", "std::tanh(x)"},
+		{"SoftPlus", "std::log1p(std::exp(x))"},
+		{"ReLU", "(x > 0.0 ? x : 0.0)"},
+		{"FastSigmoid", "1.0/(1.0 + fast_exp(-x))"},
+		{"FastTanH", "fast_tanh(x)"},
+		{"FastSoftPlus", "(x > 36.0 ? x : std::log1p(fast_exp(x)))"},
+		{"FastReLU", "(x > 0.0 ? x : 0.0)"}
+	};
+
+	auto activation_name = [](const Layer& layer) {
+		return (layer.sigma->is_fast() ? "Fast" : "") + layer.sigma->get_name();
+	};
+
+	string guard = name + "_HPP";
+	transform(guard.begin(), guard.end(), guard.begin(), ::toupper);
+
+	fout << "/* generated by cml, do not edit */" << endl
+		 << "#ifndef " << guard << endl
+		 << "#define " << guard << endl
+		 << endl
+		 << "#include <cmath>" << endl
+		 << "#include <cstdint>" << endl
+		 << "#include <cstring>" << endl
+		 << "#include <algorithm>" << endl
+		 << endl
+		 << "namespace " << name << " {" << endl
+		 << endl
+		 << "constexpr int n_inputs = " << layers.front().n_inputs << ";" << endl
+		 << "constexpr int n_outputs = " << layers.back().n_outputs << ";" << endl
+		 << endl;
+
+	/* weights and biases, in hexadecimal so they are exact */
+	fout << hexfloat;
+	for (size_t l = 0; l < layers.size(); ++l) {
+		const VectorXd& b = layers[l].get_biases();
+
+		if (layers[l].is_pruned()) {
+			/* only the kept weights, in compressed sparse row format; the
+			 * arrays have at least one element to be valid c++ */
+			const Layer::SparseMatrixXd W = layers[l].get_sparse_weights();
+			const int nnz = W.nonZeros();
+
+			fout << "constexpr int W" << l << "_row_start[" << W.rows() + 1 << "] = {";
+			for (int i = 0; i <= W.rows(); ++i)
+				fout << W.outerIndexPtr()[i] << (i < W.rows() ? ", " : "");
+			fout << "};" << endl << endl;
+
+			fout << "constexpr int W" << l << "_col[" << max(nnz, 1) << "] = {";
+			for (int k = 0; k < nnz; ++k)
+				fout << W.innerIndexPtr()[k] << (k + 1 < nnz ? ", " : "");
+			fout << (nnz == 0 ? "0" : "") << "};" << endl << endl;
+
+			fout << "constexpr double W" << l << "_val[" << max(nnz, 1) << "] = {";
+			for (int k = 0; k < nnz; ++k)
+				fout << W.valuePtr()[k] << (k + 1 < nnz ? ", " : "");
+			fout << (nnz == 0 ? "0.0" : "") << "};" << endl << endl;
+		} else {
+			const MatrixXd& W = layers[l].get_weights();
+
+			fout << "constexpr double W" << l << "[" << W.rows() << "][" << W.cols() << "] = {" << endl;
+			for (int i = 0; i < W.rows(); ++i) {
+				fout << "\t{";
+				for (int j = 0; j < W.cols(); ++j)
+					fout << W(i, j) << (j + 1 < W.cols() ? ", " : "");
+				fout << "}," << endl;
+			}
+			fout << "};" << endl << endl;
+		}
+
+		fout << "constexpr double b" << l << "[" << b.size() << "] = {";
+		for (int i = 0; i < b.size(); ++i)
+			fout << b(i) << (i + 1 < b.size() ? ", " : "");
+		fout << "};" << endl << endl;
+	}
+	fout << defaultfloat;
+
+	/* fixed size kernels, the loops are fully unrolled by the compiler */
+	fout << "template <int n_out, int n_in>" << endl
+		 << "inline void dense(const double (&W)[n_out][n_in], const double (&b)[n_out]," << endl
+		 << "\t\tconst double (&x)[n_in], double (&z)[n_out])" << endl
+		 << "{" << endl
+		 << "\t#pragma GCC unroll 65534" << endl
+		 << "\tfor (int i = 0; i < n_out; ++i) {" << endl
+		 << "\t\tdouble sum = 0.0;" << endl
+		 << "\t\t#pragma GCC unroll 65534" << endl
+		 << "\t\tfor (int j = 0; j < n_in; ++j)" << endl
+		 << "\t\t\tsum += W[i][j]*x[j];" << endl
+		 << "\t\tz[i] = sum + b[i];" << endl
+		 << "\t}" << endl
+		 << "}" << endl
+		 << endl;
+
+	fout << "template <int n_out, int n_in, int nnz>" << endl
+		 << "inline void sparse(const int (&row_start)[n_out + 1], const int (&col)[nnz]," << endl
+		 << "\t\tconst double (&val)[nnz], const double (&b)[n_out]," << endl
+		 << "\t\tconst double (&x)[n_in], double (&z)[n_out])" << endl
+		 << "{" << endl
+		 << "\t#pragma GCC unroll 65534" << endl
+		 << "\tfor (int i = 0; i < n_out; ++i) {" << endl
+		 << "\t\tdouble sum = 0.0;" << endl
+		 << "\t\tfor (int k = row_start[i]; k < row_start[i + 1]; ++k)" << endl
+		 << "\t\t\tsum += val[k]*x[col[k]];" << endl
+		 << "\t\tz[i] = sum + b[i];" << endl
+		 << "\t}" << endl
+		 << "}" << endl
+		 << endl;
+
+	/* the polynomial approximations of Sigma, for fast activations */
+	fout << "inline double fast_exp(double x)" << endl
+		 << "{" << endl
+		 << "\tx = std::min(std::max(x, -708.0), 708.0);" << endl
+		 << endl
+		 << "\tconst double y = x*1.4426950408889634;" << endl
+		 << "\tconst double n = std::floor(y + 0.5);" << endl
+		 << "\tconst double f = (y - n)*0.6931471805599453;" << endl
+		 << endl
+		 << "\tconst double p = 1.0 + f*(1.0 + f*(1.0/2 + f*(1.0/6 + f*(1.0/24" << endl
+		 << "\t\t+ f*(1.0/120 + f*(1.0/720 + f*(1.0/5040)))))));" << endl
+		 << endl
+		 << "\tconst int64_t bits = ((int64_t)n + 1023) << 52;" << endl
+		 << "\tdouble scale;" << endl
+		 << "\tstd::memcpy(&scale, &bits, sizeof(scale));" << endl
+		 << endl
+		 << "\treturn p*scale;" << endl
+		 << "}" << endl
+		 << endl
+		 << "inline double fast_tanh(double x)" << endl
+		 << "{" << endl
+		 << "\tconst double x2 = x*x;" << endl
+		 << "\tconst double series = x*(1.0 + x2*(-1.0/3 + x2*(2.0/15 + x2*(-17.0/315" << endl
+		 << "\t\t+ x2*(62.0/2835)))));" << endl
+		 << endl
+		 << "\tconst double e = fast_exp(2.0*std::min(std::max(x, -20.0), 20.0));" << endl
+		 << "\tconst double quotient = (e - 1.0)/(e + 1.0);" << endl
+		 << endl
+		 << "\treturn (std::abs(x) < 0.25 ? series : quotient);" << endl
+		 << "}" << endl
+		 << endl;
+
+	for (const auto& [activation, expression] : activations) {
+		fout << "template <int n>" << endl
+			 << "inline void " << activation << "(double (&z)[n])" << endl
+			 << "{" << endl
+			 << "\t#pragma GCC unroll 65534" << endl
+			 << "\tfor (int i = 0; i < n; ++i) {" << endl
+			 << "\t\tconst double x = z[i];" << endl
+			 << "\t\tz[i] = " << expression << ";" << endl
+			 << "\t}" << endl
+			 << "}" << endl
+			 << endl;
+	}
+
+	fout << "inline void predict(const double (&x)[n_inputs], double (&y)[n_outputs])" << endl
+		 << "{" << endl;
+	for (size_t l = 0; l < layers.size(); ++l) {
+		const string activation = activation_name(layers[l]);
+		assert(activations.count(activation) == 1);
+
+		const string a_in = (l == 0 ? "x" : "a" + to_string(l - 1));
+		const string a_out = (l + 1 == layers.size() ? "y" : "a" + to_string(l));
+
+		if (l + 1 < layers.size())
+			fout << "\tdouble " << a_out << "[" << layers[l].n_outputs << "];" << endl;
+		if (layers[l].is_pruned())
+			fout << "\tsparse(W" << l << "_row_start, W" << l << "_col, W" << l << "_val, b" << l
+				 << ", " << a_in << ", " << a_out << ");" << endl;
+		else
+			fout << "\tdense(W" << l << ", b" << l << ", " << a_in << ", " << a_out << ");" << endl;
+		fout << "\t" << activation << "(" << a_out << ");" << endl;
+	}
+	fout << "}" << endl
+		 << endl
+		 << "}" << endl
+		 << endl
+		 << "#endif" << endl;
+
+	fout.close();
+
+	cout << "Exported neural network to '" << file_name << "'" << endl << endl;
+}
+
+void Network::prune(double sparsity)
+{
+	cout << "Pruning neural network to " << fixed << setprecision(2)
+		 << 100.0*sparsity << "% sparsity:" << endl;
+
+	for (Layer& layer : layers) {
+		layer.prune(sparsity);
+
+		cout << "- " << layer.n_inputs << " inputs, "
+			 << layer.n_outputs << " outputs, "
+			 << 100.0*layer.get_sparsity() << "% zero weights"
+			 << endl;
+	}
+
+	cout << endl;
+}
@@ -2,13 +2,19 @@
 #define NETWORK_HPP
 
 #include <map>
+#include <cmath>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
 #include <string>
 #include <memory>
+#include <functional>
 #include <chrono>
 #include <vector>
 #include <fstream>
 #include <iostream>
 #include <Eigen/Dense>
+#include <Eigen/Sparse>
 #include <iomanip>
 
 #include "random.hpp"
@@ -18,21 +24,102 @@ class Sigma {
 	public:
 		using MatrixXd = Eigen::MatrixXd;
 
-		virtual MatrixXd eval(MatrixXd x) const = 0;
+		/* in fast mode exp and tanh are approximated by polynomials with a
+		 * relative error below 1e-7 */
+		Sigma(bool fast = false) : fast{fast} {}
 
-		virtual MatrixXd deriv(MatrixXd x) const = 0;
+		virtual ~Sigma() = default;
+
+		/* activations work in place, so they can be applied to a tile of the
+		 * layer output without copying it */
+		virtual void eval(Eigen::Ref<MatrixXd> x) const = 0;
+
+		virtual void deriv(Eigen::Ref<MatrixXd> x) const = 0;
+
+		/* activations that can compute the derivative from their output let
+		 * the layer keep the output of the forward pass instead of z */
+		virtual bool has_output_deriv() const { return false; }
+
+		virtual void output_deriv(Eigen::Ref<MatrixXd> a) const { deriv(a); }
 
 		virtual std::string get_name() const = 0;
+
+		bool is_fast() const { return fast; }
+
+	protected:
+		const bool fast;
+
+		/* apply f to every coefficient, vectorized along the columns */
+		template <typename F>
+		static void apply(Eigen::Ref<MatrixXd> x, F f) {
+			for (int j = 0; j < x.cols(); ++j) {
+				double* col = x.col(j).data();
+
+				#pragma omp simd
+				for (int i = 0; i < x.rows(); ++i)
+					col[i] = f(col[i]);
+			}
+		}
+
+		/* 2^n * 2^f with n = round(x/ln(2)) and a polynomial for 2^f */
+		static double fast_exp(double x) {
+			x = std::min(std::max(x, -708.0), 708.0);
+
+			const double y = x*1.4426950408889634;
+			const double n = std::floor(y + 0.5);
+			const double f = (y - n)*0.6931471805599453;
+
+			const double p = 1.0 + f*(1.0 + f*(1.0/2 + f*(1.0/6 + f*(1.0/24
+				+ f*(1.0/120 + f*(1.0/720 + f*(1.0/5040)))))));
+
+			const int64_t bits = ((int64_t)n + 1023) << 52;
+			double scale;
+			std::memcpy(&scale, &bits, sizeof(scale));
+
+			return p*scale;
+		}
+
+		static double fast_expm1(double x) {
+			/* exp(x) - 1 cancels for small x, use the series there */
+			const double series = x*(1.0 + x*(1.0/2 + x*(1.0/6 + x*(1.0/24
+				+ x*(1.0/120 + x*(1.0/720 + x*(1.0/5040)))))));
+
+			return (std::abs(x) < 0.25 ? series : fast_exp(x) - 1.0);
+		}
+
+		static double fast_tanh(double x) {
+			/* the quotient cancels for small x, use the series there */
+			const double x2 = x*x;
+			const double series = x*(1.0 + x2*(-1.0/3 + x2*(2.0/15 + x2*(-17.0/315
+				+ x2*(62.0/2835)))));
+
+			const double e = fast_exp(2.0*std::min(std::max(x, -20.0), 20.0));
+			const double quotient = (e - 1.0)/(e + 1.0);
+
+			return (std::abs(x) < 0.25 ? series : quotient);
+		}
 };
 
 class Sigmoid : public Sigma {
 	public:
-		MatrixXd eval(MatrixXd x) const override {
-			return 1.0/(1.0 + exp(-x.array()));
+		using Sigma::Sigma;
+
+		void eval(Eigen::Ref<MatrixXd> x) const override {
+			if (fast)
+				apply(x, [](double x){ return 1.0/(1.0 + fast_exp(-x)); });
+			else
+				x = 1.0/(1.0 + exp(-x.array()));
+		}
+
+		void deriv(Eigen::Ref<MatrixXd> x) const override {
+			eval(x);
+			output_deriv(x);
 		}
 
-		MatrixXd deriv(MatrixXd x) const override {
-			return exp(x.array())/pow(exp(x.array()) + 1.0, 2);
+		bool has_output_deriv() const override { return true; }
+
+		void output_deriv(Eigen::Ref<MatrixXd> a) const override {
+			a.array() *= 1.0 - a.array();
 		}
 
 		std::string get_name() const override { return "Sigmoid"; };
@@ -40,12 +127,24 @@ class Sigmoid : public Sigma {
 
 class TanH : public Sigma {
 	public:
-		MatrixXd eval(MatrixXd x) const override {
-			return tanh(x.array());
+		using Sigma::Sigma;
+
+		void eval(Eigen::Ref<MatrixXd> x) const override {
+			if (fast)
+				apply(x, [](double x){ return fast_tanh(x); });
+			else
+				x = tanh(x.array());
 		}
 
-		MatrixXd deriv(MatrixXd x) const override {
-			return 1 - pow(tanh(x.array()), 2);
+		void deriv(Eigen::Ref<MatrixXd> x) const override {
+			eval(x);
+			output_deriv(x);
+		}
+
+		bool has_output_deriv() const override { return true; }
+
+		void output_deriv(Eigen::Ref<MatrixXd> a) const override {
+			a = 1.0 - a.array().square();
 		}
 
 		std::string get_name() const override { return "TanH"; };
@@ -53,12 +152,33 @@ class TanH : public Sigma {
 
 class SoftPlus : public Sigma {
 	public:
-		MatrixXd eval(MatrixXd x) const override {
-			return log(1 + exp(x.array()));
+		using Sigma::Sigma;
+
+		void eval(Eigen::Ref<MatrixXd> x) const override {
+			/* log1p keeps the small outputs for negative x exact, the
+			 * derivative is computed from them */
+			if (fast)
+				apply(x, [](double x){ return (x > 36.0 ? x : std::log1p(fast_exp(x))); });
+			else
+				x = exp(x.array()).log1p();
 		}
 
-		MatrixXd deriv(MatrixXd x) const override {
-			return 1.0/(1 + exp(-x.array()));
+		void deriv(Eigen::Ref<MatrixXd> x) const override {
+			if (fast)
+				apply(x, [](double x){ return 1.0/(1.0 + fast_exp(-x)); });
+			else
+				x = 1.0/(1 + exp(-x.array()));
+		}
+
+		/* the derivative is the sigmoid, 1 - exp(-a), which is computed
+		 * with expm1 as it cancels for small a */
+		bool has_output_deriv() const override { return true; }
+
+		void output_deriv(Eigen::Ref<MatrixXd> a) const override {
+			if (fast)
+				apply(a, [](double a){ return -fast_expm1(-a); });
+			else
+				a = -(-a.array()).expm1();
 		}
 
 		std::string get_name() const override { return "SoftPlus"; };
@@ -66,12 +186,21 @@ class SoftPlus : public Sigma {
 
 class ReLU : public Sigma {
 	public:
-		MatrixXd eval(MatrixXd x) const override {
-			return x.unaryExpr([&](double x){ return (x > 0.0 ? x : 0.0); });
+		using Sigma::Sigma;
+
+		void eval(Eigen::Ref<MatrixXd> x) const override {
+			x = x.cwiseMax(0.0);
 		}
 
-		MatrixXd deriv(MatrixXd x) const override {
-			return x.unaryExpr([&](double x){ return (x > 0.0 ? 1.0 : 0.0); });
+		void deriv(Eigen::Ref<MatrixXd> x) const override {
+			x = (x.array() > 0.0).cast<double>();
+		}
+
+		/* a > 0 exactly where z > 0 */
+		bool has_output_deriv() const override { return true; }
+
+		void output_deriv(Eigen::Ref<MatrixXd> a) const override {
+			deriv(a);
 		}
 
 		std::string get_name() const override { return "ReLU"; };
@@ -82,35 +211,59 @@ class Layer {
 	public:
 		using VectorXd = Eigen::VectorXd;
 		using MatrixXd = Eigen::MatrixXd;
+		using SparseMatrixXd = Eigen::SparseMatrix<double, Eigen::RowMajor>;
 
-		Layer(int n_inputs, int n_outputs, std::unique_ptr<Sigma> sigma) :
+		Layer(int n_inputs, int n_outputs, std::unique_ptr<Sigma> sigma,
+				RandomNumberGenerator& gen = rng) :
 			n_inputs{n_inputs}, n_outputs{n_outputs}
 		{
 			this->sigma = std::move(sigma);
 
-			W = rng(n_outputs, n_inputs)/sqrt(n_inputs);
-			b = rng(n_outputs);
+			W = gen(n_outputs, n_inputs)/sqrt(n_inputs);
+			b = gen(n_outputs);
 		}
 
-		MatrixXd feed_forward(const MatrixXd& a_in) {
-			this->a_in = a_in;
-			z = W*a_in + b.asDiagonal()*MatrixXd::Ones(b.rows(), a_in.cols());
-			return sigma->eval(z);
-		}
+		/* the product, bias and activation are computed tile by tile, so the
+		 * output is only touched while it is still in cache; z is only stored
+		 * if it is needed for the back propagation */
+		MatrixXd feed_forward(const MatrixXd& a_in, bool training = true);
 
 		MatrixXd feed_backward(const MatrixXd& dC_da_out, double alpha, double lambda,
-				double n) {
-			MatrixXd delta = dC_da_out.cwiseProduct(sigma->deriv(z));
-			MatrixXd _dC_da_out = W.transpose()*delta;
+				double n);
 
-			MatrixXd dC_dW = delta*a_in.transpose();
-			VectorXd dC_db = delta.rowwise().sum();
+		/* set the weights with the smallest magnitudes to zero, so that the
+		 * given fraction of the weights is zero; they stay zero in further
+		 * training, which can be used to fine-tune the remaining ones */
+		void prune(double sparsity);
 
-			W -= alpha/a_in.cols()*dC_dW + alpha*lambda/n*W;
-			b -= alpha/a_in.cols()*dC_db;
+		double get_sparsity() const;
 
-			return _dC_da_out;
-		}
+		/* write and read the weights and biases in binary form, the weights
+		 * of pruned layers in compressed sparse row format */
+		void save(std::ostream& out) const;
+
+		void load(std::istream& in);
+
+		/* dense copy of the weights, also for sparse layers */
+		MatrixXd get_weights() const { return (sparse ? MatrixXd(W_sparse) : W); }
+
+		/* the kept weights of a pruned layer, in compressed sparse row format */
+		SparseMatrixXd get_sparse_weights() const;
+
+		bool is_pruned() const { return pruned; }
+
+		const VectorXd& get_biases() const { return b; }
+
+		/* number of columns processed per tile */
+		int tile_size() const;
+
+		/* size of the output tiles in bytes, should fit into the L2 cache */
+		static int tile_bytes;
+
+		/* pruned layers with at most this fraction of kept weights are held
+		 * and computed in sparse form, denser ones stay dense with a mask;
+		 * this is decided when a layer is pruned or loaded */
+		static double max_sparse_density;
 
 		const int n_inputs;
 		const int n_outputs;
@@ -118,20 +271,50 @@ class Layer {
 		std::unique_ptr<Sigma> sigma;
 
 	private:
+		/* z holds the output instead, if sigma has an output derivative */
 		MatrixXd W, a_in, z;
 		VectorXd b;
+
+		using MatrixXb = Eigen::Matrix<bool, Eigen::Dynamic, Eigen::Dynamic>;
+
+		/* the weights of a pruned layer are either held in W with a mask of
+		 * the kept weights, or only in compressed sparse row format with W
+		 * empty; the kept weights are the ones that are still trained */
+		MatrixXb W_mask;
+		SparseMatrixXd W_sparse;
+		bool pruned = false;
+		bool sparse = false;
+
+		/* choose the form of the kept weights by their density */
+		void set_pruned(const SparseMatrixXd& W_kept);
+
+		void sparse_feed_forward(const Eigen::Ref<const MatrixXd>& a_in,
+				Eigen::Ref<MatrixXd> a_out);
+
+		/* gradient step on the kept weights, delta is stored in z */
+		void sparse_update(double step, double decay);
 };
 
 
 class Cost {
 	public:
 		using MatrixXd = Eigen::MatrixXd;
+		using Labels = Data::Labels;
 
 		virtual double eval(MatrixXd a, MatrixXd y) const = 0;
 
 		virtual MatrixXd deriv(MatrixXd a, MatrixXd y) const = 0;
 
+		/* the same for targets given as class indices, the one-hot targets
+		 * are never formed */
+		virtual double eval(const MatrixXd& a, const Labels& y) const = 0;
+
+		virtual MatrixXd deriv(const MatrixXd& a, const Labels& y) const = 0;
+
 		virtual std::string get_name() const = 0;
+
+	protected:
+		static double finite(double x) { return (std::isfinite(x) ? x : 0.0); }
 };
 
 class MSE : public Cost {
@@ -144,6 +327,21 @@ class MSE : public Cost {
 			return (a - y);
 		}
 
+		/* |a - y|^2 = |a|^2 - 2 a_label + 1 */
+		double eval(const MatrixXd& a, const Labels& y) const override {
+			double C = a.squaredNorm() + y.size();
+			for (int i = 0; i < y.size(); ++i)
+				C -= 2*a(y(i), i);
+			return 0.5*C;
+		}
+
+		MatrixXd deriv(const MatrixXd& a, const Labels& y) const override {
+			MatrixXd dC_da = a;
+			for (int i = 0; i < y.size(); ++i)
+				dC_da(y(i), i) -= 1.0;
+			return dC_da;
+		}
+
 		std::string get_name() const override { return "Mean Squared Error"; };
 };
 
@@ -160,13 +358,42 @@ class CrossEntropy : public Cost {
 			return tmp.unaryExpr([&](double x){ return (std::isfinite(x) ? x : 0.0); });
 		}
 
+		/* every output contributes -log(1 - a), except for the one of the
+		 * label, which contributes -log(a) */
+		double eval(const MatrixXd& a, const Labels& y) const override {
+			double C = (-log(1 - a.array())).unaryExpr(&finite).sum();
+			for (int i = 0; i < y.size(); ++i) {
+				const double a_label = a(y(i), i);
+				C += finite(-std::log(a_label)) - finite(-std::log(1 - a_label));
+			}
+			return C;
+		}
+
+		/* 1/(1 - a), and -1/a for the output of the label */
+		MatrixXd deriv(const MatrixXd& a, const Labels& y) const override {
+			MatrixXd dC_da = (1.0/(1 - a.array())).unaryExpr(&finite);
+			for (int i = 0; i < y.size(); ++i)
+				dC_da(y(i), i) = finite(-1.0/a(y(i), i));
+			return dC_da;
+		}
+
 		std::string get_name() const override { return "Cross Entropy"; };
 };
 
 
+/* training parameters chosen by Network::autotune */
+struct TrainingConfig {
+	int batch_size;
+	int n_threads;
+	int tile_bytes;
+	double samples_per_second;
+};
+
+
 class Network {
 	public:
 		using VectorXd = Eigen::VectorXd;
+		using MatrixXd = Eigen::MatrixXd;
 
 		Network(Data& data, std::vector<Layer>& layers);
 
@@ -180,14 +407,51 @@ class Network {
 		void train(double alpha, int epochs, int batch_size, std::shared_ptr<Cost> cost,
 				double lambda, bool do_validation_inbetween, bool do_tests_inbetween);
 
+		/* continue training on the sets appended to the data since the last
+		 * training, mixed with replay_ratio times as many previous sets */
+		void train_incremental(double alpha, int epochs, int batch_size,
+				std::shared_ptr<Cost> cost, double lambda, double replay_ratio,
+				bool do_validation_inbetween, bool do_tests_inbetween);
+
 		void test(int n_incorrect, const std::map<int, std::string>& map = {}) const;
 
+		/* time short runs of the feed forward and back propagation for batch
+		 * sizes in [min_batch_size, max_batch_size], thread counts and tile
+		 * sizes, apply the fastest configuration and return it; the choice is
+		 * cached in cache_file per machine and network layout */
+		TrainingConfig autotune(int min_batch_size, int max_batch_size,
+				const std::string& cache_file = "autotune.csv", double trial_time = 0.1);
+
+		/* store the trained weights, so a later run can start from them */
+		void save(const std::string& file_name) const;
+
+		void load(const std::string& file_name);
+
+		/* write a self-contained header with the weights as constexpr arrays
+		 * and a predict() function in the namespace name */
+		void export_header(const std::string& file_name, const std::string& name) const;
+
+		/* prune every layer to the given sparsity */
+		void prune(double sparsity);
+
 	private:
 		Data& data;
 		std::vector<Layer>& layers;
 
 		std::chrono::time_point<std::chrono::high_resolution_clock> wtime_start;
 
+		void _train(double alpha, int epochs, std::shared_ptr<Cost> cost, double lambda,
+				bool do_validation_inbetween, bool do_tests_inbetween,
+				const std::function<void()>& begin_epoch,
+				const std::function<bool(Data::Sets&)>& next_batch);
+
+		double _time_training(int batch_size, double trial_time);
+
+		/* class with the largest output of every set */
+		static Data::Labels _predict(const MatrixXd& a);
+
+		static int _count_correct(const MatrixXd& a, const Data::Labels& labels);
+
 		void _validate(std::shared_ptr<Cost> cost, std::ofstream& fout) const;
 
 		void _test(std::shared_ptr<Cost> cost, std::ofstream& fout) const;
@@ -1,39 +1,173 @@
 #ifndef RANDOM_HPP
 #define RANDOM_HPP
 
+#include <array>
+#include <cmath>
 #include <random>
-#include <algorithm>
+#include <vector>
+#include <cstdint>
+#include <numeric>
 #include <Eigen/Dense>
 
 #include <iostream>
 
+/* Philox4x32-10 counter-based generator (Salmon et al., SC'11): every 128 bit
+ * counter is mapped to 128 random bits by a keyed bijection, so any position
+ * of the stream can be computed independently of all others */
+class Philox4x32 {
+	public:
+		using Counter = std::array<uint32_t, 4>;
+		using Key = std::array<uint32_t, 2>;
+
+		static Counter block(Counter ctr, Key key) {
+			for (int round = 0; round < 10; ++round) {
+				uint64_t p0 = (uint64_t)M0*ctr[0];
+				uint64_t p1 = (uint64_t)M1*ctr[2];
+
+				ctr = {
+					(uint32_t)(p1 >> 32) ^ ctr[1] ^ key[0], (uint32_t)p1,
+					(uint32_t)(p0 >> 32) ^ ctr[3] ^ key[1], (uint32_t)p0
+				};
+
+				key[0] += W0;
+				key[1] += W1;
+			}
+
+			return ctr;
+		}
+
+	private:
+		static constexpr uint32_t M0 = 0xD2511F53;
+		static constexpr uint32_t M1 = 0xCD9E8D57;
+		static constexpr uint32_t W0 = 0x9E3779B9;
+		static constexpr uint32_t W1 = 0xBB67AE85;
+};
+
+/* Normally distributed random numbers from a Philox stream. The stream is
+ * identified by (seed, stream), the position in it by a 64 bit block counter.
+ * A generator is not shared between threads, instead every thread or layer
+ * gets its own stream via split(), which is free and reproducible. */
 class RandomNumberGenerator {
 	public:
 		using VectorXd = Eigen::VectorXd;
 		using MatrixXd = Eigen::MatrixXd;
 
-		RandomNumberGenerator() : gen{std::random_device()()}, dist{0.0, 1.0} {}
+		RandomNumberGenerator() : RandomNumberGenerator(std::random_device()()) {}
+
+		RandomNumberGenerator(uint64_t seed, uint64_t stream = 0) {
+			this->seed(seed, stream);
+		}
+
+		void seed(uint64_t seed, uint64_t stream = 0) {
+			_seed = seed;
+			_stream = stream;
+			counter = 0;
+		}
+
+		uint64_t get_seed() const { return _seed; }
+
+		uint64_t get_stream() const { return _stream; }
+
+		/* independent generator with the same seed */
+		RandomNumberGenerator split(uint64_t stream) const {
+			return RandomNumberGenerator(_seed, stream);
+		}
 
-		double operator()() {return dist(gen);}
+		double operator()() {
+			double x;
+			fill_normal(&x, 1);
+			return x;
+		}
 
 		VectorXd operator()(int ni) {
-			return VectorXd::NullaryExpr(ni, [&](){return dist(gen);});
+			VectorXd x(ni);
+			fill_normal(x.data(), ni);
+			return x;
 		}
 
 		MatrixXd operator()(int ni, int nj) {
-			return MatrixXd::NullaryExpr(ni, nj, [&](){return dist(gen);});
+			MatrixXd x(ni, nj);
+			fill_normal(x.data(), (int64_t)ni*nj);
+			return x;
 		}
 
 		std::vector<int> random_indices(int n) {
 			std::vector<int> index(n);
 			std::iota(std::begin(index), std::end(index), 0);
-			std::shuffle(std::begin(index), std::end(index), gen);
+
+			std::vector<uint32_t> bits((n + 3)/4*4);
+			fill_bits(bits.data(), bits.size()/4);
+
+			/* Fisher-Yates, with Lemire's multiply-shift to map onto [0, i] */
+			for (int i = n - 1; i > 0; --i) {
+				int j = ((uint64_t)bits[i]*(uint64_t)(i + 1)) >> 32;
+				std::swap(index[i], index[j]);
+			}
+
 			return index;
 		}
 
 	private:
-		std::mt19937 gen;
-		std::normal_distribution<double> dist;
+		uint64_t _seed;
+		uint64_t _stream;
+		uint64_t counter;
+
+		Philox4x32::Key key() const {
+			return {(uint32_t)_seed, (uint32_t)(_seed >> 32)};
+		}
+
+		/* write n_blocks*4 random 32 bit words and advance the counter */
+		void fill_bits(uint32_t* bits, int64_t n_blocks) {
+			const Philox4x32::Key k = key();
+			const uint64_t c0 = counter;
+			const uint64_t s = _stream;
+
+			#pragma omp simd
+			for (int64_t i = 0; i < n_blocks; ++i) {
+				const uint64_t c = c0 + i;
+				Philox4x32::Counter r = Philox4x32::block(
+					{(uint32_t)c, (uint32_t)(c >> 32), (uint32_t)s, (uint32_t)(s >> 32)}, k
+				);
+				bits[4*i + 0] = r[0];
+				bits[4*i + 1] = r[1];
+				bits[4*i + 2] = r[2];
+				bits[4*i + 3] = r[3];
+			}
+
+			counter += n_blocks;
+		}
+
+		/* each block gives two uniforms in (0, 1] and with Box-Muller two
+		 * standard normal numbers */
+		void fill_normal(double* x, int64_t n) {
+			const int64_t n_blocks = (n + 1)/2;
+
+			std::vector<uint32_t> bits(4*n_blocks);
+			fill_bits(bits.data(), n_blocks);
+
+			constexpr double two_pi = 6.283185307179586;
+			constexpr double two_m53 = 1.0/9007199254740992.0;
+
+			#pragma omp simd
+			for (int64_t i = 0; i < n/2; ++i) {
+				const uint64_t b0 = ((uint64_t)bits[4*i + 1] << 32) | bits[4*i + 0];
+				const uint64_t b1 = ((uint64_t)bits[4*i + 3] << 32) | bits[4*i + 2];
+				const double u0 = ((b0 >> 11) + 1)*two_m53;
+				const double u1 = ((b1 >> 11) + 1)*two_m53;
+				const double r = std::sqrt(-2.0*std::log(u0));
+				x[2*i + 0] = r*std::cos(two_pi*u1);
+				x[2*i + 1] = r*std::sin(two_pi*u1);
+			}
+
+			if (n%2 == 1) {
+				const int64_t i = n_blocks - 1;
+				const uint64_t b0 = ((uint64_t)bits[4*i + 1] << 32) | bits[4*i + 0];
+				const uint64_t b1 = ((uint64_t)bits[4*i + 3] << 32) | bits[4*i + 2];
+				const double u0 = ((b0 >> 11) + 1)*two_m53;
+				const double u1 = ((b1 >> 11) + 1)*two_m53;
+				x[n - 1] = std::sqrt(-2.0*std::log(u0))*std::cos(two_pi*u1);
+			}
+		}
 };
 
 extern RandomNumberGenerator rng;
@@ -0,0 +1,45 @@
+#include "data.hpp"
+#include "network.hpp"
+
+using namespace std;
+
+int main()
+{
+	CSV data("data/xor", 900, 100);
+
+	vector<Layer> layers;
+	layers.emplace_back(Layer(2, 4, make_unique<SoftPlus>()));
+	/* the fast approximation is exported as well */
+	layers.emplace_back(Layer(4, 2, make_unique<Sigmoid>(true)));
+
+	Network net(data, layers);
+
+	net.train(1.0, 5, 2, make_unique<CrossEntropy>(), 1.0, false, false);
+
+	/* the first layer is exported in sparse form */
+	layers[0].prune(0.5);
+	net.train(1.0, 1, 2, make_unique<CrossEntropy>(), 1.0, false, false);
+
+	/* and stored in sparse form */
+	net.save("bin/xor_model.bin");
+	net.load("bin/xor_model.bin");
+
+	net.export_header("bin/xor_model.hpp", "xor_model");
+
+	/* reference outputs of the library for the test data */
+	const Data::Sets test_data = data.get_test_sets();
+
+	Eigen::MatrixXd a = test_data.first;
+	for (Layer& layer : layers)
+		a = layer.feed_forward(a, false);
+
+	ofstream fout("bin/xor_model.ref", ios::binary);
+	assert(fout.is_open());
+
+	int n_sets = a.cols();
+	fout.write((char*)&n_sets, sizeof(n_sets));
+	fout.write((char*)test_data.first.data(), test_data.first.size()*sizeof(double));
+	fout.write((char*)a.data(), a.size()*sizeof(double));
+
+	fout.close();
+}
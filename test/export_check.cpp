@@ -0,0 +1,56 @@
+#include "xor_model.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <cassert>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+/* compares the exported network with the reference outputs of the library,
+ * only the generated header is used here */
+int main()
+{
+	ifstream fin("bin/xor_model.ref", ios::binary);
+	assert(fin.is_open());
+
+	int n_sets;
+	fin.read((char*)&n_sets, sizeof(n_sets));
+
+	vector<double> inputs(n_sets*xor_model::n_inputs);
+	vector<double> outputs(n_sets*xor_model::n_outputs);
+
+	fin.read((char*)inputs.data(), inputs.size()*sizeof(double));
+	fin.read((char*)outputs.data(), outputs.size()*sizeof(double));
+	assert(fin.good());
+
+	int n_identical = 0;
+	double max_error = 0.0;
+
+	for (int s = 0; s < n_sets; ++s) {
+		double x[xor_model::n_inputs];
+		double y[xor_model::n_outputs];
+
+		memcpy(x, &inputs[s*xor_model::n_inputs], sizeof(x));
+
+		xor_model::predict(x, y);
+
+		for (int i = 0; i < xor_model::n_outputs; ++i) {
+			const double y_ref = outputs[s*xor_model::n_outputs + i];
+
+			if (memcmp(&y[i], &y_ref, sizeof(double)) == 0)
+				++n_identical;
+
+			max_error = max(max_error, abs(y[i] - y_ref));
+		}
+	}
+
+	cout << n_identical << "/" << n_sets*xor_model::n_outputs
+		 << " outputs bit-for-bit identical, max. error " << max_error << endl;
+
+	/* the library sums in a different order and uses the vectorized exp of
+	 * eigen, so the last bits may differ */
+	return (max_error <= 1e-12 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
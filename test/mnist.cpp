@@ -15,7 +15,9 @@ int main()
 
 	Network net(data, layers);
 
-	net.train(0.5, 30, 10, make_unique<CrossEntropy>(), 0.1, true, false);
+	const TrainingConfig config = net.autotune(10, 40);
+
+	net.train(0.5, 30, config.batch_size, make_unique<CrossEntropy>(), 0.1, true, false);
 
 	net.test(1);
 }
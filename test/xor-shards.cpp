@@ -0,0 +1,21 @@
+#include "data.hpp"
+#include "network.hpp"
+
+using namespace std;
+
+int main()
+{
+	/* convert the in-memory data set to shards, next to the binaries */
+	CSV csv("data/xor", 900, 100);
+	Shards::write_shards(csv, "bin/xor_shards", 100);
+
+	Shards data("bin/xor_shards", 2);
+
+	vector<Layer> layers;
+	layers.emplace_back(Layer(2, 4, make_unique<Sigmoid>()));
+	layers.emplace_back(Layer(4, 2, make_unique<Sigmoid>()));
+
+	Network net(data, layers);
+
+	net.train(1.0, 5, 2, make_unique<CrossEntropy>(), 1.0, true, true);
+}